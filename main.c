@@ -25,6 +25,16 @@
 
 #define TARGET_FPS 165
 
+#define FRAME_LATE_TOLERANCE 1.1
+#define FRAME_HEADROOM 0.6
+#define FRAME_SHED_AFTER 3
+#define FRAME_RESTORE_AFTER (TARGET_FPS * 2)
+#define FRAME_JITTER_SMOOTHING 0.05
+
+#define PACING_LOG_INTERVAL 5
+
+#define BAR_SHED_STRIDE 4
+
 #define GRID_COLS 64
 
 #define BAR_HEIGHT 32
@@ -32,6 +42,9 @@
 
 #define MUSIC_BAR_BANDS 128
 
+// DrawBars averages whole groups of bands when shedding bar detail
+_Static_assert(MUSIC_BAR_BANDS % BAR_SHED_STRIDE == 0, "bar shed stride must divide the band count");
+
 #define VOLUME_STEP 0.2
 #define VOLUME_WIDTH SCREEN_WIDTH / 4
 #define VOLUME_HEIGHT 32
@@ -46,6 +59,32 @@
 
 #define DECAY_SPEED 2500
 
+#define BALLS_COUNT (34 + 35)
+#define BALL_MIN_RADIUS 35
+#define BALL_MAX_RADIUS 68
+#define BALL_BASE_SPEED 75
+#define BALL_MAX_SPEED 600
+#define BALL_DAMPING 1.5
+#define BALL_KICK 400
+
+#define PARTICLE_MIN_SIZE 10
+#define PARTICLE_MAX_SIZE 34
+#define PARTICLE_BASE_SPEED 350
+#define PARTICLE_MAX_SPEED 1200
+#define PARTICLE_DAMPING 2
+#define PARTICLE_KICK 2
+#define PARTICLE_BALL_KICK 40
+
+#define BROADPHASE_SLACK 24
+#define BROADPHASE_CELL (2 * BALL_MAX_RADIUS + BROADPHASE_SLACK)
+#define BROADPHASE_COLS (SCREEN_WIDTH / BROADPHASE_CELL + 1)
+#define BROADPHASE_ROWS (SCREEN_HEIGHT / BROADPHASE_CELL + 1)
+#define BROADPHASE_CELLS (BROADPHASE_COLS * BROADPHASE_ROWS)
+
+// a 3x3 query only finds everything if a cell covers the longest reach
+_Static_assert(BROADPHASE_CELL > 2 * BALL_MAX_RADIUS, "broadphase cell smaller than ball-ball reach");
+_Static_assert(BROADPHASE_CELL > BALL_MAX_RADIUS + PARTICLE_MAX_SIZE / 2, "broadphase cell smaller than ball-particle reach");
+
 static unsigned int tracksLength = 0;
 char** tracks = NULL;
 static float popupDuration = 0;
@@ -89,11 +128,41 @@ typedef struct {
 
 static MusicData md = {};
 
-Ball balls[34 + 35] = {};
+Ball balls[BALLS_COUNT] = {};
 bool musicLoaded = false;
 
 static float frameTime = 0;
 
+/*
+    The loop paces itself instead of SetTargetFPS, so the time spent up to and
+    including EndDrawing (batch flush and swap) is known before sleeping.
+    Optional work is shed one level at a time while that work runs over
+    budget and given back once there is headroom again.
+*/
+typedef enum {
+    SHED_NONE,
+    SHED_PARTICLE_DENSITY,
+    SHED_BACKGROUND,
+    SHED_BAR_DETAIL,
+} ShedLevel;
+
+typedef struct {
+    float budget;
+    double frameStart;
+    float work;
+    float period;
+    float jitter;
+    float worstFrame;
+    unsigned int frames;
+    unsigned int missed;
+    unsigned int overStreak;
+    unsigned int headroomFrames;
+    double lastLog;
+    ShedLevel shed;
+} FrameScheduler;
+
+static FrameScheduler scheduler = { .budget = 1.0 / TARGET_FPS };
+
 void DataGrabber(void* buffer, unsigned int frames)
 {
     if (buffer == NULL || frames == 0)
@@ -322,10 +391,17 @@ void ChangeVolume(Music* music, bool inc)
 
 void DrawBars()
 {
-    for (int i = 0; i < MUSIC_BAR_BANDS; i++) {
+    int stride = scheduler.shed >= SHED_BAR_DETAIL ? BAR_SHED_STRIDE : 1;
+
+    for (int i = 0; i < MUSIC_BAR_BANDS; i += stride) {
+        float band = 0;
+        for (int j = i; j < i + stride; j++)
+            band += md.bands[j];
+        band /= stride;
+
         int x = SCREEN_WIDTH / MUSIC_BAR_BANDS * i;
-        int w = SCREEN_WIDTH / MUSIC_BAR_BANDS;
-        int h = (SCREEN_HEIGHT - BAR_HEIGHT) * (seekState.seeking ? 0.3 + (0.5 / (float)(random() % 8)) : md.bands[i]);
+        int w = SCREEN_WIDTH / MUSIC_BAR_BANDS * stride;
+        int h = (SCREEN_HEIGHT - BAR_HEIGHT) * (seekState.seeking ? 0.3 + (0.5 / (float)(random() % 8)) : band);
         int y = (SCREEN_HEIGHT - BAR_HEIGHT) - h;
 
         DrawRectangle(x, y, w, h, (Color) { (seekState.seeking) ? random() % 255 : 245, (seekState.seeking) ? random() % 255 : 169, (seekState.seeking) ? random() % 255 : 184, 100 });
@@ -383,8 +459,21 @@ void BallOutOfBounds(Ball* ball)
     }
 }
 
+// eases speed above base back down, so audio kicks fade out instead of stacking
+Vector2 DampSpeed(Vector2 dir, float base, float damping)
+{
+    float speed = Vector2Length(dir);
+
+    if (speed <= base)
+        return dir;
+
+    return Vector2Scale(dir, Lerp(speed, base, fmin(damping * frameTime, 1)) / speed);
+}
+
 void MoveBall(Ball* ball)
 {
+    ball->dir = DampSpeed(ball->dir, BALL_BASE_SPEED, BALL_DAMPING);
+
     ball->pos.x = ball->pos.x + (ball->dir.x * frameTime);
     ball->pos.y = ball->pos.y + (ball->dir.y * frameTime);
 
@@ -441,6 +530,214 @@ void PushBall(Vector2 mouse, Ball* ball)
     BallOutOfBounds(ball);
 }
 
+/*
+    Uniform grid over the balls, rebuilt every frame with a counting sort.
+    Cells are bigger than any ball diameter, so particles and balls only
+    have to look at the 3x3 cells around them instead of every ball.
+*/
+typedef struct {
+    int cellStart[BROADPHASE_CELLS + 1];
+    int cellBalls[BALLS_COUNT];
+} Broadphase;
+
+static Broadphase broadphase = { 0 };
+
+int BroadphaseColumn(float x)
+{
+    return Clamp(x / BROADPHASE_CELL, 0, BROADPHASE_COLS - 1);
+}
+
+int BroadphaseRow(float y)
+{
+    return Clamp(y / BROADPHASE_CELL, 0, BROADPHASE_ROWS - 1);
+}
+
+void BuildBroadphase()
+{
+    int cursor[BROADPHASE_CELLS] = { 0 };
+
+    for (int i = 0; i < BALLS_COUNT; i++)
+        cursor[BroadphaseRow(balls[i].pos.y) * BROADPHASE_COLS + BroadphaseColumn(balls[i].pos.x)]++;
+
+    broadphase.cellStart[0] = 0;
+    for (int c = 0; c < BROADPHASE_CELLS; c++) {
+        broadphase.cellStart[c + 1] = broadphase.cellStart[c] + cursor[c];
+        cursor[c] = broadphase.cellStart[c];
+    }
+
+    for (int i = 0; i < BALLS_COUNT; i++)
+        broadphase.cellBalls[cursor[BroadphaseRow(balls[i].pos.y) * BROADPHASE_COLS + BroadphaseColumn(balls[i].pos.x)]++] = i;
+}
+
+void QueryBroadphase(Vector2 pos, void (*hit)(int ball, void* data), void* data)
+{
+    int cx = BroadphaseColumn(pos.x);
+    int cy = BroadphaseRow(pos.y);
+
+    int x0 = cx > 0 ? cx - 1 : 0;
+    int x1 = cx < BROADPHASE_COLS - 1 ? cx + 1 : cx;
+    int y0 = cy > 0 ? cy - 1 : 0;
+    int y1 = cy < BROADPHASE_ROWS - 1 ? cy + 1 : cy;
+
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            int cell = y * BROADPHASE_COLS + x;
+
+            for (int k = broadphase.cellStart[cell]; k < broadphase.cellStart[cell + 1]; k++)
+                hit(broadphase.cellBalls[k], data);
+        }
+    }
+}
+
+float BandEnergy(float x)
+{
+    int band = Clamp(x / (SCREEN_WIDTH / MUSIC_BAR_BANDS), 0, MUSIC_BAR_BANDS - 1);
+
+    return md.bands[band];
+}
+
+void CollideBallPair(int index, void* data)
+{
+    int self = *(int*)data;
+
+    if (index <= self)
+        return;
+
+    Ball* ball = &balls[self];
+    Ball* other = &balls[index];
+    Vector2 dist = Vector2Subtract(ball->pos, other->pos);
+    float length = Vector2Length(dist);
+    float overlap = ball->radius + other->radius - length;
+
+    if (overlap <= 0 || length == 0)
+        return;
+
+    Vector2 normal = Vector2Scale(dist, 1.0 / length);
+
+    ball->pos = Vector2Add(ball->pos, Vector2Scale(normal, overlap / 2));
+    other->pos = Vector2Subtract(other->pos, Vector2Scale(normal, overlap / 2));
+
+    float closing = Vector2DotProduct(Vector2Subtract(ball->dir, other->dir), normal);
+
+    if (closing < 0) {
+        // equal masses, so a head-on bounce just swaps the normal components
+        float kick = BALL_KICK * (BandEnergy(ball->pos.x) + BandEnergy(other->pos.x)) / 2.0;
+
+        ball->dir = Vector2ClampValue(Vector2Add(ball->dir, Vector2Scale(normal, kick - closing)), 0, BALL_MAX_SPEED);
+        other->dir = Vector2ClampValue(Vector2Subtract(other->dir, Vector2Scale(normal, kick - closing)), 0, BALL_MAX_SPEED);
+    }
+
+    BallOutOfBounds(ball);
+    BallOutOfBounds(other);
+}
+
+void CollideBall(int index)
+{
+    QueryBroadphase(balls[index].pos, CollideBallPair, &index);
+}
+
+void CollideParticleBall(int index, void* data)
+{
+    Particle* particle = (Particle*)data;
+    Ball* ball = &balls[index];
+    float half = particle->size / 2.0;
+    Vector2 center = { particle->pos.x + half, particle->pos.y + half };
+    Vector2 dist = Vector2Subtract(center, ball->pos);
+    float length = Vector2Length(dist);
+    float overlap = ball->radius + half - length;
+
+    if (overlap <= 0 || length == 0)
+        return;
+
+    Vector2 normal = Vector2Scale(dist, 1.0 / length);
+
+    center = Vector2Add(center, Vector2Scale(normal, overlap));
+    particle->pos = (Vector2) { center.x - half, center.y - half };
+
+    float closing = Vector2DotProduct(Vector2Subtract(particle->dir, ball->dir), normal);
+
+    if (closing < 0) {
+        float energy = BandEnergy(ball->pos.x);
+
+        // particles are weightless next to a ball, so only the particle bounces
+        particle->dir = Vector2Subtract(particle->dir, Vector2Scale(normal, 2 * closing));
+        particle->dir = Vector2ClampValue(Vector2Scale(particle->dir, 1 + PARTICLE_KICK * energy), 0, PARTICLE_MAX_SPEED);
+        ball->dir = Vector2ClampValue(Vector2Subtract(ball->dir, Vector2Scale(normal, PARTICLE_BALL_KICK * energy)), 0, BALL_MAX_SPEED);
+    }
+}
+
+void CollideParticle(Particle* particle)
+{
+    Vector2 center = { particle->pos.x + particle->size / 2.0, particle->pos.y + particle->size / 2.0 };
+
+    QueryBroadphase(center, CollideParticleBall, particle);
+}
+
+void UpdateScheduler()
+{
+    double now = GetTime();
+
+    if (scheduler.frameStart == 0) {
+        scheduler.frameStart = now;
+        scheduler.lastLog = now;
+        return;
+    }
+
+    float period = now - scheduler.frameStart;
+
+    scheduler.frameStart = now;
+    scheduler.frames++;
+
+    // stats only: how long the whole frame took, sleep included
+    scheduler.jitter = Lerp(scheduler.jitter, fabs(period - scheduler.period), FRAME_JITTER_SMOOTHING);
+    scheduler.period = period;
+    if (period > scheduler.worstFrame)
+        scheduler.worstFrame = period;
+    if (period > scheduler.budget * FRAME_LATE_TOLERANCE)
+        scheduler.missed++;
+
+    // shedding and restoring both look at the work done before the sleep
+    if (scheduler.work > scheduler.budget) {
+        scheduler.overStreak++;
+        scheduler.headroomFrames = 0;
+    } else {
+        scheduler.overStreak = 0;
+        if (scheduler.work < scheduler.budget * FRAME_HEADROOM)
+            scheduler.headroomFrames++;
+        else
+            scheduler.headroomFrames = 0;
+    }
+
+    if (scheduler.overStreak >= FRAME_SHED_AFTER && scheduler.shed < SHED_BAR_DETAIL) {
+        scheduler.shed++;
+        scheduler.overStreak = 0;
+        printf("[+] pacing: over budget, shed level %d\n", scheduler.shed);
+    } else if (scheduler.headroomFrames >= FRAME_RESTORE_AFTER && scheduler.shed > SHED_NONE) {
+        scheduler.shed--;
+        scheduler.headroomFrames = 0;
+        printf("[+] pacing: headroom, shed level %d\n", scheduler.shed);
+    }
+
+    if (now - scheduler.lastLog >= PACING_LOG_INTERVAL) {
+        printf("[+] pacing: %u frames, %u missed (%.1f%%), jitter %.2fms, worst %.2fms, shed level %d\n",
+            scheduler.frames, scheduler.missed, 100.0 * scheduler.missed / scheduler.frames,
+            scheduler.jitter * 1000, scheduler.worstFrame * 1000, scheduler.shed);
+
+        scheduler.frames = 0;
+        scheduler.missed = 0;
+        scheduler.worstFrame = 0;
+        scheduler.lastLog = now;
+    }
+}
+
+void PaceFrame()
+{
+    scheduler.work = GetTime() - scheduler.frameStart;
+
+    if (scheduler.work < scheduler.budget)
+        WaitTime(scheduler.budget - scheduler.work);
+}
+
 void DrawMyBackground()
 {
     int cellSize = fmax(SCREEN_WIDTH / GRID_COLS, SCREEN_HEIGHT / GRID_COLS);
@@ -529,7 +826,7 @@ int main(void)
         balls[i] = (Ball) { .pos
             = { random() % SCREEN_WIDTH, random() % SCREEN_HEIGHT },
             .dir = { random() % 50 + 25, random() % 50 + 25 },
-            .radius = random() % 34 + 35,
+            .radius = random() % (BALL_MAX_RADIUS - BALL_MIN_RADIUS + 1) + BALL_MIN_RADIUS,
             .col = (Color) { random() % 255, random() % 255, random() % 255, 100 + random() % 125 } };
     }
 
@@ -542,8 +839,6 @@ int main(void)
     ChangeSong(&music, true, false);
     SetMasterVolume(md.currentVolume);
 
-    SetTargetFPS(TARGET_FPS);
-
     Image penger_img = LoadImage(PENGER_IMG);
     Texture2D penger_texture = LoadTextureFromImage(penger_img);
     UnloadImage(penger_img);
@@ -556,6 +851,8 @@ int main(void)
     while (!WindowShouldClose()) {
         frameTime = GetFrameTime();
 
+        UpdateScheduler();
+
         UpdateMusicStream(music);
 
         if (IsKeyPressed(KEY_SPACE))
@@ -602,7 +899,7 @@ int main(void)
                     particles[m] = (Particle) {
                         .pos = (Vector2) { mousePos.x, mousePos.y },
                         .dir = (Vector2) { -250 + random() % 500, -250 + random() % 500 },
-                        .size = random() % 25 + 10,
+                        .size = random() % (PARTICLE_MAX_SIZE - PARTICLE_MIN_SIZE + 1) + PARTICLE_MIN_SIZE,
                         .col = (Color) {
                             random() % 255,
                             random() % 255,
@@ -626,11 +923,16 @@ int main(void)
         BeginDrawing();
         ClearBackground((Color) { 24, 24, 24, 255 });
 
-        DrawMyBackground();
+        if (scheduler.shed < SHED_BACKGROUND)
+            DrawMyBackground();
 
         DrawBars();
 
+        BuildBroadphase();
+
         for (int i = 0; i < sizeof(balls) / sizeof(Ball); i++) {
+            CollideBall(i);
+
             if (BallInMouseRadius(mousePos, &balls[i]))
                 PushBall(mousePos, &balls[i]);
             else
@@ -641,6 +943,9 @@ int main(void)
 
         DrawTitleText();
 
+        // balls moved since the last build, re-bin them before the particles query
+        BuildBroadphase();
+
         // TODO: dynamic array
         for (int i = 0; i < 1024; i++) {
             if (particles[i].started == 0 && particles[i].current == 0 && particles[i].decayRate == 0)
@@ -651,9 +956,12 @@ int main(void)
             if (alpha < 0)
                 continue;
             particles[i].current = GetTime();
+            particles[i].dir = DampSpeed(particles[i].dir, PARTICLE_BASE_SPEED, PARTICLE_DAMPING);
             particles[i].pos.x = particles[i].pos.x + (particles[i].dir.x * GetFrameTime());
             particles[i].pos.y = particles[i].pos.y + (particles[i].dir.y * GetFrameTime());
 
+            CollideParticle(&particles[i]);
+
             if (particles[i].pos.x < 0) {
                 particles[i].pos.x = 0;
                 particles[i].dir.x = fabs(particles[i].dir.x);
@@ -676,6 +984,9 @@ int main(void)
 
             particles[i].col.a = alpha;
 
+            if (scheduler.shed >= SHED_PARTICLE_DENSITY && i % 2)
+                continue;
+
             DrawRectangle(particles[i].pos.x, particles[i].pos.y, particles[i].size, particles[i].size, particles[i].col);
         }
 
@@ -686,6 +997,8 @@ int main(void)
         DrawVolumeBar();
 
         EndDrawing();
+
+        PaceFrame();
     }
 
     UnloadMusicStream(music);